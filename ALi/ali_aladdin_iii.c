@@ -15,11 +15,14 @@
  *		Copyright 2020 Tiseno100.
  */
 
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
+#define HAVE_STDARG_H
 #include <86box/86box.h>
 #include <86box/device.h>
 #include <86box/io.h>
@@ -35,24 +38,116 @@
 #include <86box/spd.h>
 #include <86box/chipset.h>
 
+#ifdef ENABLE_ALADDIN_III_LOG
+int aladdin_iii_do_log = ENABLE_ALADDIN_III_LOG;
+static void
+aladdin_iii_log(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (aladdin_iii_do_log)
+    {
+        va_start(ap, fmt);
+        pclog_ex(fmt, ap);
+        va_end(ap);
+    }
+}
+
+/* Writes remapping at least this many bytes get reported, i.e. any 47h hole or eight 4ch-4fh segments */
+#define ALADDIN_III_CHURN_LOG 0x20000
+#else
+#define aladdin_iii_log(fmt, ...)
+#endif
+
+/* SMI Sources */
+#define ALADDIN_III_SMI_APM 0x01
+
 typedef struct aladdin_iii_t
 {
     uint8_t pci_conf[256], pci_conf_sb[2][256];
 
     int use_internal_ide;
+    uint16_t shadow_state[16]; /* Last applied state per 16K segment, 0xffff after reset so everything gets remapped */
+    uint8_t irq_steering[8], smi_enable;
+
+    /* Snapshot sequence, odd while registers are being updated */
+    atomic_uint seq;
+    int seq_depth;
+
+    /* Statistics */
+    uint32_t writes, remaps, flushes;
+    uint32_t remapped; /* Bytes of memory map changed, for the churn log */
 
     smram_t *smram;
     port_92_t *port_92;
     apm_t *apm;
 } aladdin_iii_t;
 
+/*
+Snapshot sequence around register updates. Only the emulation thread writes
+so plain stores do. Resets run the write handlers themselves so only the
+outermost bracket counts.
+*/
+static void
+aladdin_iii_seq_begin(aladdin_iii_t *dev)
+{
+    if (!dev->seq_depth++)
+    {
+        atomic_store_explicit(&dev->seq, atomic_load_explicit(&dev->seq, memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+}
+
+static void
+aladdin_iii_seq_end(aladdin_iii_t *dev)
+{
+    if (!--dev->seq_depth)
+        atomic_store_explicit(&dev->seq, atomic_load_explicit(&dev->seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/*
+Shadow Control
+4ch/4eh: C0000-DFFFF Read/Write Enable (half 0)
+4dh/4fh: E0000-FFFFF Read/Write Enable (half 1)
+Decoding is kept free of side effects so it can be checked on its own.
+Only segments of the half the written register belongs to whose state
+actually changed get remapped.
+*/
+static void
+aladdin_iii_shadow_decode(uint8_t can_read, uint8_t can_write, uint16_t *state)
+{
+    for (uint32_t i = 0; i < 8; i++)
+        state[i] = ((can_read & (1 << i)) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((can_write & (1 << i)) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY);
+}
+
 static void
-aladdin_iii_shadow_recalc(aladdin_iii_t *dev)
+aladdin_iii_shadow_recalc(aladdin_iii_t *dev, int half)
 {
+    uint32_t base = 0xc0000 + (half << 17);
+    uint16_t states[8], state, *cur;
+    int changed = 0;
+
+    aladdin_iii_shadow_decode(dev->pci_conf[0x4c + half], dev->pci_conf[0x4e + half], states);
+
     for (uint32_t i = 0; i < 8; i++)
     {
-        mem_set_mem_state_both((0xc0000 + (i << 14)), 0x4000, ((dev->pci_conf[0x4c] & (1 << i)) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->pci_conf[0x4e] & (1 << i)) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
-        mem_set_mem_state_both((0xe0000 + (i << 14)), 0x4000, ((dev->pci_conf[0x4d] & (1 << i)) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->pci_conf[0x4f] & (1 << i)) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
+        state = states[i];
+        cur = &dev->shadow_state[(half << 3) + i];
+
+        if (*cur == state)
+            continue;
+
+        *cur = state;
+        changed = 1;
+        mem_set_mem_state_both((base + (i << 14)), 0x4000, state);
+        dev->remaps++;
+        dev->remapped += 0x4000;
+    }
+
+    if (changed)
+    {
+        flushmmucache_nopc();
+        dev->flushes++;
     }
 }
 
@@ -65,27 +160,133 @@ aladdin_iii_smm_recalc(aladdin_iii_t *dev)
         {
         case 0x00:
             smram_enable(dev->smram, 0xd0000, 0xb0000, 0x10000, 0, 1);
+            dev->remaps++;
             break;
         case 0x01:
             smram_enable(dev->smram, 0xd0000, 0xb0000, 0x10000, 1, 1);
+            dev->remaps++;
             break;
         case 0x02:
             smram_enable(dev->smram, 0xa0000, 0xa0000, 0x20000, 0, 1);
+            dev->remaps++;
             break;
         case 0x03:
             if (!(dev->pci_conf[0x47] & 0x04))
+            {
                 smram_enable(dev->smram, 0xa0000, 0xa0000, 0x20000, 1, 1);
+                dev->remaps++;
+            }
+            else
+            {
+                smram_disable_all();
+                dev->remaps++;
+            }
             break;
         case 0x04:
             smram_enable(dev->smram, 0x30000, 0xb0000, 0x20000, 0, 1);
+            dev->remaps++;
             break;
         case 0x05:
             smram_enable(dev->smram, 0x30000, 0xb0000, 0x20000, 1, 1);
+            dev->remaps++;
             break;
         }
     }
     else
+    {
         smram_disable_all();
+        dev->remaps++;
+    }
+}
+
+/*
+Memory Holes (47h)
+Bit 1: 80000-9FFFF to the ISA bus
+Bit 2: A0000-BFFFF to DRAM
+Bit 3: F00000-FFFFFF to DRAM, ISA hole when clear
+The holes are page map states so ordinary RAM accesses never check them.
+Only regions whose bit flipped get remapped.
+*/
+static void
+aladdin_iii_hole_recalc(aladdin_iii_t *dev, uint8_t changed)
+{
+    uint8_t val = dev->pci_conf[0x47];
+
+    if (changed & 0x02)
+    {
+        mem_set_mem_state_both(0x80000, 0x20000, (val & 0x02) ? (MEM_READ_EXTANY | MEM_WRITE_EXTANY) : (MEM_READ_INTERNAL | MEM_WRITE_INTERNAL));
+        dev->remaps++;
+        dev->remapped += 0x20000;
+    }
+
+    if (changed & 0x04)
+    {
+        mem_set_mem_state_both(0xa0000, 0x20000, !(val & 0x04) ? (MEM_READ_EXTANY | MEM_WRITE_EXTANY) : (MEM_READ_INTERNAL | MEM_WRITE_INTERNAL));
+        dev->remaps++;
+        dev->remapped += 0x20000;
+    }
+
+    if (changed & 0x08)
+    {
+        mem_set_mem_state_both(0xf00000, 0x100000, !(val & 0x08) ? (MEM_READ_EXTANY | MEM_WRITE_EXTANY) : (MEM_READ_INTERNAL | MEM_WRITE_INTERNAL));
+        dev->remaps++;
+        dev->remapped += 0x100000;
+    }
+
+    if (changed & 0x0e)
+    {
+        flushmmucache_nopc();
+        dev->flushes++;
+    }
+}
+
+/*
+M1523 PCI IRQ Routing
+0h: Disabled  1h: IRQ9   2h: IRQ3   3h: IRQ10
+4h: IRQ4      5h: IRQ5   6h: IRQ7   7h: IRQ6
+8h: IRQ1      9h: IRQ11  Ah: --     Bh: IRQ12
+Ch: --        Dh: IRQ14  Eh: --     Fh: IRQ15
+*/
+static const uint8_t aladdin_iii_irq_routing[16] = {
+    PCI_IRQ_DISABLED, 9, 3, 10, 4, 5, 7, 6, 1, 11, PCI_IRQ_DISABLED, 12, PCI_IRQ_DISABLED, 14, PCI_IRQ_DISABLED, 15
+};
+
+/* Decode a routing nibble and hand it to the PCI bus only when the line really moved */
+static void
+aladdin_iii_irq_steer(aladdin_iii_t *dev, int pci_int, uint8_t val)
+{
+    uint8_t irq = aladdin_iii_irq_routing[val & 0x0f];
+
+    if (dev->irq_steering[pci_int - 1] == irq)
+        return;
+
+    dev->irq_steering[pci_int - 1] = irq;
+    pci_set_irq_routing(pci_int, irq);
+}
+
+/*
+Builds the mask of SMI sources the south bridge may currently raise and
+only tells the affected source handlers when it changes.
+56h Bit 6: SMI Enable
+56h Bit 4: APM SMI Enable
+*/
+static void
+aladdin_iii_smi_recalc(aladdin_iii_t *dev)
+{
+    uint8_t smi_enable = 0;
+    uint8_t changed;
+
+    if (dev->pci_conf_sb[0][0x56] & 0x40)
+    {
+        if (dev->pci_conf_sb[0][0x56] & 0x10)
+            smi_enable |= ALADDIN_III_SMI_APM;
+    }
+
+    changed = smi_enable ^ dev->smi_enable;
+    dev->smi_enable = smi_enable;
+
+    if (changed & ALADDIN_III_SMI_APM)
+        apm_set_do_smi(dev->apm, !!(smi_enable & ALADDIN_III_SMI_APM));
 }
 
 static void
@@ -101,8 +302,8 @@ aladdin_iii_ide_handler(aladdin_iii_t *dev)
         ide_set_side(0, 0x3f6);
 
         ide_sec_enable();
-        ide_set_base(0, 0x170);
-        ide_set_side(0, 0x376);
+        ide_set_base(1, 0x170);
+        ide_set_side(1, 0x376);
     }
 }
 
@@ -110,7 +311,29 @@ static void
 aladdin_iii_write(int func, int addr, uint8_t val, void *priv)
 {
     aladdin_iii_t *dev = (aladdin_iii_t *)priv;
+    uint8_t old = dev->pci_conf[addr];
+#ifdef ENABLE_ALADDIN_III_LOG
+    uint32_t remapped = dev->remapped;
+#endif
 
+    aladdin_iii_log("M1521-NB: dev->regs[%02x] = %02x\n", addr, val);
+
+    switch (addr)
+    {
+    case 0x00: /* Read Only */
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x08:
+    case 0x09:
+    case 0x0a:
+    case 0x0b:
+    case 0x0e:
+        return;
+    }
+
+    aladdin_iii_seq_begin(dev);
+    dev->writes++;
     dev->pci_conf[addr] = val;
 
     switch (addr)
@@ -120,20 +343,25 @@ aladdin_iii_write(int func, int addr, uint8_t val, void *priv)
         break;
 
     case 0x47:
-        mem_set_mem_state_both(0x80000, 0x20000, (val & 0x02) ? (MEM_READ_EXTANY | MEM_WRITE_EXTANY) : (MEM_READ_INTERNAL | MEM_WRITE_INTERNAL));
-        mem_set_mem_state_both(0xa0000, 0x20000, !(val & 0x04) ? (MEM_READ_EXTANY | MEM_WRITE_EXTANY) : (MEM_READ_INTERNAL | MEM_WRITE_INTERNAL));
-        mem_set_mem_state_both(0xf00000, 0x100000, !(val & 0x08) ? (MEM_READ_EXTANY | MEM_WRITE_EXTANY) : (MEM_READ_INTERNAL | MEM_WRITE_INTERNAL));
+        aladdin_iii_hole_recalc(dev, val ^ old);
+
+        /* SMRAM at A0000 depends on the A0000 hole */
+        if ((val ^ old) & 0x04)
+            aladdin_iii_smm_recalc(dev);
         break;
 
     case 0x48:
-        aladdin_iii_smm_recalc(dev);
+        if (val != old)
+            aladdin_iii_smm_recalc(dev);
         break;
 
     case 0x4c:
     case 0x4d:
     case 0x4e:
     case 0x4f:
-        aladdin_iii_shadow_recalc(dev);
+        /* The PCI bus splits wider accesses into bytes so skip the ones not changing anything */
+        if (val != old)
+            aladdin_iii_shadow_recalc(dev, addr & 0x01);
         break;
 
     case 0x60:
@@ -147,7 +375,12 @@ aladdin_iii_write(int func, int addr, uint8_t val, void *priv)
         spd_write_drbs(dev->pci_conf, 0x60, 0x6f, 2);
         break;
     }
-    pclog("M1521-NB: dev->regs[%02x] = %02x\n", addr, val);
+    aladdin_iii_seq_end(dev);
+
+#ifdef ENABLE_ALADDIN_III_LOG
+    if ((dev->remapped - remapped) >= ALADDIN_III_CHURN_LOG)
+        aladdin_iii_log("M1521-NB: Write to %02x remapped %u bytes\n", addr, dev->remapped - remapped);
+#endif
 }
 
 static uint8_t
@@ -163,6 +396,34 @@ aladdin_iii_sb_write(int func, int addr, uint8_t val, void *priv)
 {
     aladdin_iii_t *dev = (aladdin_iii_t *)priv;
 
+    if (func > 1)
+        return;
+
+    aladdin_iii_log("M1523-%s: dev->regs[%02x] = %02x\n", func ? "IDE" : "SB", addr, val);
+
+    switch (addr)
+    {
+    case 0x00: /* Read Only */
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x08:
+    case 0x0a:
+    case 0x0b:
+    case 0x0e:
+        return;
+
+    case 0x09:
+        if (!func)
+            return;
+
+        /* IDE Programming Interface: only the channel mode bits 0 & 2 are programmable */
+        val = (dev->pci_conf_sb[1][0x09] & ~0x05) | (val & 0x05);
+        break;
+    }
+
+    aladdin_iii_seq_begin(dev);
+    dev->writes++;
     if (!func)
     {
         dev->pci_conf_sb[0][addr] = val;
@@ -176,42 +437,73 @@ aladdin_iii_sb_write(int func, int addr, uint8_t val, void *priv)
             break;
 
         case 0x46:
-        dev->use_internal_ide = (val & 0x10);
-        break;
+            dev->use_internal_ide = (val & 0x10);
+            if (dev->use_internal_ide)
+                aladdin_iii_ide_handler(dev);
+            else
+            {
+                ide_pri_disable();
+                ide_sec_disable();
+            }
+            break;
 
         case 0x48:
-            pci_set_irq_routing(PCI_INTA, (val & 0x0f));
-            pci_set_irq_routing(PCI_INTB, (val & 0xf0));
+            aladdin_iii_irq_steer(dev, PCI_INTA, val);
+            aladdin_iii_irq_steer(dev, PCI_INTB, val >> 4);
             break;
 
         case 0x49:
-            pci_set_irq_routing(PCI_INTC, (val & 0x0f));
-            pci_set_irq_routing(PCI_INTD, (val & 0xf0));
+            aladdin_iii_irq_steer(dev, PCI_INTC, val);
+            aladdin_iii_irq_steer(dev, PCI_INTD, val >> 4);
             break;
 
         case 0x50:
-            pci_set_irq_routing(5, (val & 0x0f));
-            pci_set_irq_routing(6, (val & 0xf0));
+            aladdin_iii_irq_steer(dev, 5, val);
+            aladdin_iii_irq_steer(dev, 6, val >> 4);
             break;
 
         case 0x51:
-            pci_set_irq_routing(7, (val & 0x0f));
-            pci_set_irq_routing(8, (val & 0xf0));
+            aladdin_iii_irq_steer(dev, 7, val);
+            aladdin_iii_irq_steer(dev, 8, val >> 4);
             break;
 
         case 0x56:
-            apm_set_do_smi(dev->apm, ((val & 0x10) && (val & 0x40)));
+            aladdin_iii_smi_recalc(dev);
             break;
         }
-        pclog("M1523-SB: dev->regs[%02x] = %02x\n", addr, val);
     }
     else
     {
         dev->pci_conf_sb[1][addr] = val;
-        if(dev->use_internal_ide)
-        aladdin_iii_ide_handler(dev);
-        pclog("M1523-IDE: dev->regs[%02x] = %02x\n", addr, val);
+        if((addr == 0x50) && dev->use_internal_ide)
+            aladdin_iii_ide_handler(dev);
     }
+    aladdin_iii_seq_end(dev);
+}
+
+/*
+Chipset inspector snapshot. nb: 256 bytes, sb: 512 bytes (function 0 then 1),
+shadow_state: 16 entries from C0000h, stats: writes, remaps, flushes
+*/
+void
+aladdin_iii_snapshot(void *priv, uint8_t *nb, uint8_t *sb, uint16_t *shadow_state, uint32_t *stats)
+{
+    aladdin_iii_t *dev = (aladdin_iii_t *)priv;
+    unsigned int seq;
+
+    do
+    {
+        seq = atomic_load_explicit(&dev->seq, memory_order_acquire);
+
+        memcpy(nb, dev->pci_conf, sizeof(dev->pci_conf));
+        memcpy(sb, dev->pci_conf_sb, sizeof(dev->pci_conf_sb));
+        memcpy(shadow_state, dev->shadow_state, sizeof(dev->shadow_state));
+        stats[0] = dev->writes;
+        stats[1] = dev->remaps;
+        stats[2] = dev->flushes;
+
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || (seq != atomic_load_explicit(&dev->seq, memory_order_relaxed)));
 }
 
 static uint8_t
@@ -219,7 +511,7 @@ aladdin_iii_sb_read(int func, int addr, void *priv)
 {
     aladdin_iii_t *dev = (aladdin_iii_t *)priv;
 
-    return (!func) ? dev->pci_conf_sb[1][addr] : dev->pci_conf_sb[0][addr];
+    return (func <= 1) ? dev->pci_conf_sb[func][addr] : 0xff;
 }
 
 static void
@@ -227,6 +519,8 @@ aladdin_iii_reset(void *priv)
 {
     aladdin_iii_t *dev = (aladdin_iii_t *)priv;
 
+    aladdin_iii_seq_begin(dev);
+
     /* North Bridge */
     dev->pci_conf[0x00] = 0xb9;
     dev->pci_conf[0x01] = 0x10;
@@ -239,13 +533,18 @@ aladdin_iii_reset(void *priv)
     dev->pci_conf[0x0d] = 0x20;
     dev->pci_conf[0x5a] = 0x20;
 
+    memset(dev->shadow_state, 0xff, sizeof(dev->shadow_state));
     aladdin_iii_write(0, 0x42, 0x00, dev);
-    aladdin_iii_write(0, 0x47, 0x00, dev);
-    aladdin_iii_write(0, 0x48, 0x00, dev);
-    aladdin_iii_write(0, 0x4c, 0x00, dev);
-    aladdin_iii_write(0, 0x4d, 0x00, dev);
-    aladdin_iii_write(0, 0x4e, 0x00, dev);
-    aladdin_iii_write(0, 0x4f, 0x00, dev);
+    dev->pci_conf[0x47] = 0x00;
+    aladdin_iii_hole_recalc(dev, 0x0e);
+    dev->pci_conf[0x48] = 0x00;
+    aladdin_iii_smm_recalc(dev);
+    dev->pci_conf[0x4c] = 0x00;
+    dev->pci_conf[0x4d] = 0x00;
+    dev->pci_conf[0x4e] = 0x00;
+    dev->pci_conf[0x4f] = 0x00;
+    aladdin_iii_shadow_recalc(dev, 0);
+    aladdin_iii_shadow_recalc(dev, 1);
 
     /* South Bridge */
     dev->pci_conf_sb[0][0x00] = 0xb9;
@@ -257,6 +556,9 @@ aladdin_iii_reset(void *priv)
     dev->pci_conf_sb[0][0x0b] = 0x06;
     dev->pci_conf_sb[0][0x0e] = 0x80;
 
+    memset(dev->irq_steering, 0, sizeof(dev->irq_steering)); /* Nothing routes to IRQ 0, forces a reload */
+    dev->smi_enable = 0xff;
+
     aladdin_iii_sb_write(0, 0x43, 0x00, dev);
     aladdin_iii_sb_write(0, 0x46, 0x00, dev);
     aladdin_iii_sb_write(0, 0x48, 0x00, dev);
@@ -287,6 +589,8 @@ aladdin_iii_reset(void *priv)
     dev->pci_conf_sb[1][0x3e] = 0x02;
     dev->pci_conf_sb[1][0x3f] = 0x04;
     aladdin_iii_sb_write(1, 0x50, 0x00, dev);
+
+    aladdin_iii_seq_end(dev);
 }
 
 static void
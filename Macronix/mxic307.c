@@ -18,6 +18,7 @@
  */
 
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -57,15 +58,60 @@ typedef struct
     uint8_t index, regs[256];
 
     /* Shadowing */
-    uint16_t can_read, can_write;
-    uint32_t base;
+    uint16_t shadow_state[7]; /* Applied segment states, start at 0xffff to force the first remap */
+
+    /* Inspector snapshot sequence, odd during writes */
+    atomic_uint seq;
+
+    /* Statistics */
+    uint32_t writes, remaps, flushes;
 
 } mxic307_t;
 
+/*
+Indexes belonging to the MXIC 307, one bit each. Ports 22h/23h are shared
+with the Cyrix CCRs and other chipsets so anything else is left alone.
+*/
+static const uint8_t mxic307_owned[32] = {
+    [0x06] = 0xf0, /* 34h-37h */
+    [0x07] = 0x7f  /* 38h-3eh */
+};
+
+#define mxic307_owns(index) (mxic307_owned[(index) >> 3] & (1 << ((index) & 7)))
+
+/* Decodes 3ah into the state of segments 0-6 without touching the device or the memory map */
+static void
+mxic307_shadow_decode(uint8_t val, uint16_t *state)
+{
+    uint16_t shadow = ((val & 0x80) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((val & 0x40) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY);
+
+    for (uint32_t i = 0; i < 6; i++)
+        state[i] = (val & (1 << i)) ? shadow : (MEM_READ_EXTANY | MEM_WRITE_EXTANY);
+
+    state[6] = shadow;
+}
+
+/* Segments 0-5 are the 32KB blocks of 3ah, 6 is the F segment. Returns 1 if the segment got remapped */
+static int
+mxic307_shadow_set(mxic307_t *dev, int seg, uint32_t base, uint32_t size, uint16_t state)
+{
+    if (dev->shadow_state[seg] == state)
+        return 0;
+
+    dev->shadow_state[seg] = state;
+    mem_set_mem_state_both(base, size, state);
+    dev->remaps++;
+
+    return 1;
+}
+
 static void
 mxic307_write(uint16_t addr, uint8_t val, void *priv)
 {
     mxic307_t *dev = (mxic307_t *)priv;
+    uint16_t state[7];
+    unsigned int seq;
+    int changed;
 
     switch (addr)
     {
@@ -74,6 +120,14 @@ mxic307_write(uint16_t addr, uint8_t val, void *priv)
         break;
 
     case 0x23:
+        if (!mxic307_owns(dev->index))
+            break;
+
+        seq = atomic_load_explicit(&dev->seq, memory_order_relaxed);
+        atomic_store_explicit(&dev->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        dev->writes++;
         dev->regs[dev->index] = val;
         mxic307_log("dev->regs[%02x] = %02x \n", dev->index, val);
 
@@ -90,24 +144,19 @@ mxic307_write(uint16_t addr, uint8_t val, void *priv)
             Bit 1: C8000-CFFFF
             Bit 0: C0000-C7FFF
             */
-            dev->can_read = (val & 0x80) ? MEM_READ_INTERNAL : MEM_READ_EXTANY;
-            dev->can_write = (val & 0x40) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY;
+            mxic307_shadow_decode(val, state);
+            changed = 0;
 
             for (uint32_t i = 0; i < 6; i++)
+                changed |= mxic307_shadow_set(dev, i, 0xc0000 + (i << 15), 0x8000, state[i]);
+
+            changed |= mxic307_shadow_set(dev, 6, 0xf0000, 0x10000, state[6]);
+
+            if (changed)
             {
-                dev->base = 0xc0000 + (i << 15);
-                if (val & (1 << i))
-                    mem_set_mem_state_both(dev->base, 0x8000, dev->can_read | dev->can_write);
-                else
-                    mem_set_mem_state_both(dev->base, 0x8000, MEM_READ_EXTANY | MEM_WRITE_EXTANY);
+                flushmmucache();
+                dev->flushes++;
             }
-
-            mem_set_mem_state_both(
-                0xf0000,
-                0x10000,
-                ((val & 0x80) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) |
-                ((val & 0x40) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
-            flushmmucache();
             break;
 
         case 0x3d: /* DRAM Control */
@@ -121,15 +170,42 @@ mxic307_write(uint16_t addr, uint8_t val, void *priv)
             cpu_cache_int_enabled = (val & 0x10);
             break;
         }
+
+        atomic_store_explicit(&dev->seq, seq + 2, memory_order_release);
         break;
     }
 }
 
+/* Chipset inspector snapshot, stats: writes, remaps, flushes */
+void
+mxic307_snapshot(void *priv, uint8_t *regs, uint16_t *shadow_state, uint32_t *stats)
+{
+    mxic307_t *dev = (mxic307_t *)priv;
+    unsigned int seq;
+
+    do
+    {
+        seq = atomic_load_explicit(&dev->seq, memory_order_acquire);
+
+        memcpy(regs, dev->regs, sizeof(dev->regs));
+        memcpy(shadow_state, dev->shadow_state, sizeof(dev->shadow_state));
+        stats[0] = dev->writes;
+        stats[1] = dev->remaps;
+        stats[2] = dev->flushes;
+
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || (seq != atomic_load_explicit(&dev->seq, memory_order_relaxed)));
+}
+
 static uint8_t
 mxic307_read(uint16_t addr, void *priv)
 {
     mxic307_t *dev = (mxic307_t *)priv;
-    return (addr == 0x23) ? dev->regs[dev->index] : dev->index;
+
+    if (addr == 0x23)
+        return mxic307_owns(dev->index) ? dev->regs[dev->index] : 0xff;
+
+    return dev->index;
 }
 
 static void
@@ -145,6 +221,7 @@ mxic307_init(const device_t *info)
 {
     mxic307_t *dev = (mxic307_t *)malloc(sizeof(mxic307_t));
     memset(dev, 0, sizeof(mxic307_t));
+    memset(dev->shadow_state, 0xff, sizeof(dev->shadow_state));
 
     /*
     MXIC 307 Ports:
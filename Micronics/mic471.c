@@ -18,6 +18,7 @@
  */
 
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -62,13 +63,35 @@ typedef struct
 
     /* Shadow Registers */
     uint32_t base;
+    uint16_t shadow_state[8]; /* Current segment states(0xffff at power on, so 52h/57h remap all of them) */
+
+    /* Snapshot Sequence(odd during a write) */
+    atomic_uint seq;
+
+    /* Statistics */
+    uint32_t writes, remaps, flushes;
 
 } mic471_t;
 
+/*
+Indexes the MIC 471 answers to, one bit each. Other users of 22h/23h
+(Cyrix CCRs, other chipsets) keep theirs.
+*/
+static const uint8_t mic471_owned[32] = {
+    [0x0a] = 0xff, /* 50h-57h */
+    [0x0b] = 0xff, /* 58h-5fh */
+    [0x0c] = 0x03  /* 60h-61h */
+};
+
+#define mic471_owns(index) (mic471_owned[(index) >> 3] & (1 << ((index) & 7)))
+
 static void
 mic471_write(uint16_t addr, uint8_t val, void *priv)
 {
     mic471_t *dev = (mic471_t *)priv;
+    uint16_t state;
+    unsigned int seq;
+    int changed;
 
     switch (addr)
     {
@@ -77,6 +100,14 @@ mic471_write(uint16_t addr, uint8_t val, void *priv)
         break;
 
     case 0x23:
+        if (!mic471_owns(dev->index))
+            break;
+
+        seq = atomic_load_explicit(&dev->seq, memory_order_relaxed);
+        atomic_store_explicit(&dev->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        dev->writes++;
 
         mic471_log("MIC 471: dev->regs[%02x] = %02x\n", dev->index, val);
 
@@ -89,27 +120,72 @@ mic471_write(uint16_t addr, uint8_t val, void *priv)
             dev->can_read = (dev->regs[0x57] & 0x40) ? MEM_READ_INTERNAL : MEM_READ_DISABLED;
             dev->can_write = (dev->regs[0x57] & 0x80) ? MEM_WRITE_INTERNAL : MEM_WRITE_DISABLED;
 
+            changed = 0;
+
+            /* Remap only the segments that changed */
             for (uint32_t i = 0; i < 8; i++)
             {
                 dev->base = 0xc0000 + (i << 15);
+                state = (dev->regs[0x52] & (1 << i)) ? (dev->can_read | dev->can_write) : (MEM_READ_EXTANY | MEM_WRITE_EXTANY);
 
-                if (dev->regs[0x52] & (1 << i))
-                    mem_set_mem_state_both(dev->base, 0x8000, dev->can_read | dev->can_write);
-                else
-                    mem_set_mem_state_both(dev->base, 0x8000, MEM_READ_EXTANY | MEM_WRITE_EXTANY);
+                if (state == dev->shadow_state[i])
+                    continue;
+
+                dev->shadow_state[i] = state;
+                changed = 1;
+                mem_set_mem_state_both(dev->base, 0x8000, state);
+                dev->remaps++;
+            }
+
+            if (changed)
+            {
+                flushmmucache_nopc();
+                dev->flushes++;
             }
             break;
         }
+
+        atomic_store_explicit(&dev->seq, seq + 2, memory_order_release);
         break;
     }
 }
 
+/* Chipset inspector snapshot, stats: writes, remaps, flushes */
+void
+mic471_snapshot(void *priv, uint8_t *regs, uint16_t *shadow_state, uint32_t *stats)
+{
+    mic471_t *dev = (mic471_t *)priv;
+    unsigned int seq;
+
+    do
+    {
+        seq = atomic_load_explicit(&dev->seq, memory_order_acquire);
+
+        memcpy(regs, dev->regs, sizeof(dev->regs));
+        memcpy(shadow_state, dev->shadow_state, sizeof(dev->shadow_state));
+        stats[0] = dev->writes;
+        stats[1] = dev->remaps;
+        stats[2] = dev->flushes;
+
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || (seq != atomic_load_explicit(&dev->seq, memory_order_relaxed)));
+}
+
 static uint8_t
 mic471_read(uint16_t addr, void *priv)
 {
     mic471_t *dev = (mic471_t *)priv;
-    mic471_log("MIC 471: dev->regs[%02x] (%02x)\n", dev->index, dev->regs[dev->index]);
-    return (addr == 0x23) ? dev->regs[dev->index] : dev->index;
+
+    if (addr == 0x23)
+    {
+        if (!mic471_owns(dev->index))
+            return 0xff;
+
+        mic471_log("MIC 471: dev->regs[%02x] (%02x)\n", dev->index, dev->regs[dev->index]);
+        return dev->regs[dev->index];
+    }
+
+    return dev->index;
 }
 
 static void
@@ -125,6 +201,7 @@ mic471_init(const device_t *info)
 {
     mic471_t *dev = (mic471_t *)malloc(sizeof(mic471_t));
     memset(dev, 0, sizeof(mic471_t));
+    memset(dev->shadow_state, 0xff, sizeof(dev->shadow_state));
 
     /*
     MIC 471 Ports:
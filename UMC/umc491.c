@@ -18,6 +18,7 @@
  */
 
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,45 +55,102 @@ typedef struct
 {
     uint8_t	index,
 	regs[256];
+
+    uint16_t	shadow_state[10]; /* Applied states, 0xffff at init so the first recalc maps everything */
+
+    atomic_uint	seq; /* Odd while a write is in progress */
+    uint32_t	writes, remaps, flushes;
 } umc491_t;
 
+
+/*
+UMC 491/493 Shadow Segments
+
+Register, Read Enable bit, Write Enable bit for every segment.
+Our machine has the E segment into parts although most AMI machines treat it as one.
+Probably a flaw by the BIOS as only one register gets enabled for it anyways.
+*/
+static const struct
+{
+    uint32_t	base, size;
+    uint8_t	reg, read, write;
+} umc491_segments[10] = {
+    { 0xc0000, 0x04000, 0xcd, 0x40, 0x80 },
+    { 0xc4000, 0x04000, 0xcd, 0x10, 0x20 },
+    { 0xc8000, 0x04000, 0xcd, 0x04, 0x08 },
+    { 0xcc000, 0x04000, 0xcd, 0x01, 0x02 },
+    { 0xd0000, 0x04000, 0xce, 0x40, 0x80 },
+    { 0xd4000, 0x04000, 0xce, 0x10, 0x20 },
+    { 0xd8000, 0x04000, 0xce, 0x04, 0x08 },
+    { 0xdc000, 0x04000, 0xce, 0x01, 0x02 },
+    { 0xe0000, 0x10000, 0xcc, 0x10, 0x20 },
+    { 0xf0000, 0x10000, 0xcc, 0x40, 0x80 }
+};
+
+/*
+Pure decode of CCh-CEh into the memory state of every segment.
+Has no side effects so it can be checked against any register combination on its own.
+*/
+static void umc491_shadow_decode(const uint8_t *regs, uint16_t *state)
+{
+uint8_t val;
+
+for (int i = 0; i < 10; i++)
+{
+    val = regs[umc491_segments[i].reg];
+    state[i] = ((val & umc491_segments[i].read) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((val & umc491_segments[i].write) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY);
+}
+}
+
+/*
+Only segments whose state really changed get remapped and the MMU cache
+is left alone if none did.
+*/
 static void umc491_shadow_recalc(umc491_t *dev)
 {
+uint16_t state[10];
+int changed = 0;
 
 shadowbios = (dev->regs[0xcc] & 0x40);
 shadowbios_write = (dev->regs[0xcc] & 0x80);
 
-mem_set_mem_state_both(0xc0000, 0x4000, ((dev->regs[0xcd] & 0x40) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->regs[0xcd] & 0x80) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
-mem_set_mem_state_both(0xc4000, 0x4000, ((dev->regs[0xcd] & 0x10) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->regs[0xcd] & 0x20) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
-mem_set_mem_state_both(0xc8000, 0x4000, ((dev->regs[0xcd] & 0x04) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->regs[0xcd] & 0x08) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
-mem_set_mem_state_both(0xcc000, 0x4000, ((dev->regs[0xcd] & 0x01) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->regs[0xcd] & 0x02) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
+umc491_shadow_decode(dev->regs, state);
 
-mem_set_mem_state_both(0xd0000, 0x4000, ((dev->regs[0xce] & 0x40) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->regs[0xce] & 0x80) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
-mem_set_mem_state_both(0xd4000, 0x4000, ((dev->regs[0xce] & 0x10) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->regs[0xce] & 0x20) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
-mem_set_mem_state_both(0xd8000, 0x4000, ((dev->regs[0xce] & 0x04) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->regs[0xce] & 0x08) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
-mem_set_mem_state_both(0xdc000, 0x4000, ((dev->regs[0xce] & 0x01) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->regs[0xce] & 0x02) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
+for (int i = 0; i < 10; i++)
+{
+    if (state[i] == dev->shadow_state[i])
+        continue;
 
-/*
-Our machine has the E segment into parts although most AMI machines treat it as one.
-Probably a flaw by the BIOS as only one register gets enabled for it anyways.
-*/
-mem_set_mem_state_both(0xe0000, 0x10000, ((dev->regs[0xcc] & 0x10) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->regs[0xcc] & 0x20) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
+    dev->shadow_state[i] = state[i];
+    changed = 1;
 
-mem_set_mem_state_both(0xf0000, 0x10000, ((dev->regs[0xcc] & 0x40) ? MEM_READ_INTERNAL : MEM_READ_EXTANY) | ((dev->regs[0xcc] & 0x80) ? MEM_WRITE_INTERNAL : MEM_WRITE_EXTANY));
+    mem_set_mem_state_both(umc491_segments[i].base, umc491_segments[i].size, state[i]);
+    dev->remaps++;
+}
 
-flushmmucache();
+if (changed)
+{
+    flushmmucache();
+    dev->flushes++;
+}
 }
 
 static void
 umc491_write(uint16_t addr, uint8_t val, void *priv)
 {
     umc491_t *dev = (umc491_t *) priv;
+    unsigned int seq;
 
     switch (addr) {
 	case 0x8022:
 		dev->index = val;
 		break;
 	case 0x8024:
+        seq = atomic_load_explicit(&dev->seq, memory_order_relaxed);
+        atomic_store_explicit(&dev->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        dev->writes++;
         umc491_log("UMC 491: dev->regs[%02x] = %02x\n", dev->index, val);
 		dev->regs[dev->index] = val;
 
@@ -112,11 +170,34 @@ umc491_write(uint16_t addr, uint8_t val, void *priv)
             cpu_cache_ext_enabled = (val & 0x01);
             break;
         }
+
+        atomic_store_explicit(&dev->seq, seq + 2, memory_order_release);
 		break;
     }
 }
 
 
+/* Chipset inspector snapshot, stats: writes, remaps, flushes */
+void
+umc491_snapshot(void *priv, uint8_t *regs, uint16_t *shadow_state, uint32_t *stats)
+{
+    umc491_t *dev = (umc491_t *) priv;
+    unsigned int seq;
+
+    do {
+	seq = atomic_load_explicit(&dev->seq, memory_order_acquire);
+
+	memcpy(regs, dev->regs, sizeof(dev->regs));
+	memcpy(shadow_state, dev->shadow_state, sizeof(dev->shadow_state));
+	stats[0] = dev->writes;
+	stats[1] = dev->remaps;
+	stats[2] = dev->flushes;
+
+	atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || (seq != atomic_load_explicit(&dev->seq, memory_order_relaxed)));
+}
+
+
 static uint8_t
 umc491_read(uint16_t addr, void *priv)
 {
@@ -147,6 +228,7 @@ umc491_init(const device_t *info)
 {
     umc491_t *dev = (umc491_t *) malloc(sizeof(umc491_t));
     memset(dev, 0, sizeof(umc491_t));
+    memset(dev->shadow_state, 0xff, sizeof(dev->shadow_state));
 
     device_add(&port_92_device);
 
@@ -15,6 +15,7 @@
  */
 
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,20 +53,88 @@ typedef struct
 {
     uint8_t index, cfg_lock, set_chip_id, chip_id,
         regs[256];
+
+    uint16_t io_base; //Current configuration port base, 0 if not mapped yet
+
+    atomic_uint seq; //Inspector snapshot sequence, odd during writes
+    uint32_t writes, ide_remaps, io_remaps;
 } w8375x_t;
 
 static uint8_t w8375x_read(uint16_t addr, void *priv);
+static void w8375x_write(uint16_t addr, uint8_t val, void *priv);
+
+//Applies 81h(Channel Enable) & 85h(Channel Swap)
+static void
+w8375x_ide_handler(w8375x_t *dev)
+{
+    dev->ide_remaps++;
+    ide_pri_disable();
+    ide_sec_disable();
+
+    if (dev->regs[0x85] & 0x01)
+    {
+        ide_set_base(0, 0x1f0);
+        ide_set_side(0, 0x3f6);
+        ide_set_base(1, 0x170);
+        ide_set_side(1, 0x376);
+    }
+    else
+    {
+        ide_set_base(1, 0x1f0);
+        ide_set_side(1, 0x3f6);
+        ide_set_base(0, 0x170);
+        ide_set_side(0, 0x376);
+    }
+
+    if (dev->regs[0x81] & 0x80)
+    {
+        if (dev->regs[0x81] & 0x01)
+            ide_pri_enable();
+        else if (dev->regs[0x81] & 0x03)
+        {
+            ide_pri_enable();
+            ide_sec_enable();
+        }
+    }
+}
+
+//Moves the configuration ports only when the base really changes, rewriting 83h no longer stacks handlers
+static void
+w8375x_io_remap(w8375x_t *dev)
+{
+    uint16_t base = (dev->regs[0x83] & 0x01) ? 0x1b0 : 0x130;
+
+    if (base == dev->io_base)
+        return;
+
+    //IDIN(+0), Index(+4), Data(+8) & IDOUT(+C) Ports
+    for (int i = 0; i < 0x10; i += 4)
+    {
+        if (dev->io_base)
+            io_removehandler(dev->io_base + i, 0x0001, w8375x_read, NULL, NULL, w8375x_write, NULL, NULL, dev);
+
+        io_sethandler(base + i, 0x0001, w8375x_read, NULL, NULL, w8375x_write, NULL, NULL, dev);
+    }
+
+    dev->io_base = base;
+    dev->io_remaps += 4;
+}
 
 static void
 w8375x_write(uint16_t addr, uint8_t val, void *priv)
 {
     w8375x_t *dev = (w8375x_t *)priv;
+    unsigned int seq = atomic_load_explicit(&dev->seq, memory_order_relaxed);
+
     switch (addr)
     {
     //Chip ID determination for multi-chip mode
     case 0x1b0:
     case 0x130:
+        atomic_store_explicit(&dev->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
         dev->chip_id = val;
+        atomic_store_explicit(&dev->seq, seq + 2, memory_order_release);
         break;
 
     //Index Port
@@ -76,6 +145,10 @@ w8375x_write(uint16_t addr, uint8_t val, void *priv)
 
     case 0x1b8:
     case 0x138:
+        atomic_store_explicit(&dev->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        dev->writes++;
         dev->regs[dev->index] = val;
 
         if (!(dev->regs[0x83] & 0x02))
@@ -89,59 +162,43 @@ w8375x_write(uint16_t addr, uint8_t val, void *priv)
             switch (dev->index)
             {
             case 0x81:
-                ide_pri_disable();
-                ide_sec_disable();
-
-                if (val & 0x80)
-                {
-                    if (val & 0x01)
-                        ide_pri_enable();
-                    else if (val & 0x03)
-                    {
-                        ide_pri_enable();
-                        ide_sec_enable();
-                    }
-                }
+            case 0x85:
+                w8375x_ide_handler(dev);
                 break;
 
             case 0x83:
-                //Index Port
-                io_sethandler((dev->regs[0x83] & 0x01) ? 0x1b4 : 0x134, 0x0001, w8375x_read, NULL, NULL, w8375x_write, NULL, NULL, dev);
-
-                //Data Port
-                io_sethandler((dev->regs[0x83] & 0x01) ? 0x1b8 : 0x138, 0x0001, w8375x_read, NULL, NULL, w8375x_write, NULL, NULL, dev);
-
-                //IDIN Port
-                io_sethandler((dev->regs[0x83] & 0x01) ? 0x1b0 : 0x130, 0x0001, w8375x_read, NULL, NULL, w8375x_write, NULL, NULL, dev);
-
-                //IDOUT Port
-                io_sethandler((dev->regs[0x83] & 0x01) ? 0x1bc : 0x13c, 0x0001, w8375x_read, NULL, NULL, w8375x_write, NULL, NULL, dev);
-
+                w8375x_io_remap(dev);
                 dev->set_chip_id = 0x60 + ((val >> 2) & 0x03);
                 break;
-
-            case 0x85:
-                if (val & 0x01)
-                {
-                    ide_set_base(0, 0x1f0);
-                    ide_set_side(0, 0x3f6);
-                    ide_set_base(1, 0x170);
-                    ide_set_side(1, 0x376);
-                }
-                else
-                {
-                    ide_set_base(1, 0x1f0);
-                    ide_set_side(1, 0x3f6);
-                    ide_set_base(0, 0x170);
-                    ide_set_side(0, 0x376);
-                }
-                break;
             }
-            break;
         }
+
+        atomic_store_explicit(&dev->seq, seq + 2, memory_order_release);
+        break;
     }
 }
 
+//Chipset inspector snapshot, stats: writes, IDE remaps, I/O remaps
+void
+w8375x_snapshot(void *priv, uint8_t *regs, uint8_t *chip_id, uint32_t *stats)
+{
+    w8375x_t *dev = (w8375x_t *)priv;
+    unsigned int seq;
+
+    do
+    {
+        seq = atomic_load_explicit(&dev->seq, memory_order_acquire);
+
+        memcpy(regs, dev->regs, sizeof(dev->regs));
+        *chip_id = dev->chip_id;
+        stats[0] = dev->writes;
+        stats[1] = dev->ide_remaps;
+        stats[2] = dev->io_remaps;
+
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || (seq != atomic_load_explicit(&dev->seq, memory_order_relaxed)));
+}
+
 static uint8_t
 w8375x_read(uint16_t addr, void *priv)
 {